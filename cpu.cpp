@@ -9,6 +9,9 @@
 #include <cmath>
 #include <cstdlib>
 #include <cstdio>
+#include <sstream>
+#include <memory_resource>
+#include <time.h>
 using namespace std;
 
 typedef pair<long long,int> InterruptType;
@@ -29,14 +32,26 @@ int globalContextSwitch = 50;
 int globalPages = 75;
 int globalSwap = 1000;
 int globalCyclesPerSec = 100000;
-string FIFO = "fifo";
-string LRU = "lru";
-string SCA = "2ch-alg";
-map<string, double> processStartTime;
+pmr::string FIFO = "fifo";
+pmr::string LRU = "lru";
+pmr::string SCA = "2ch-alg";
+pmr::string NRU = "nru";
+// TLB in front of the page tables; 0 entries turns it off
+int globalTLBEntries = 64;
+int globalTLBWays = 4;
+enum TLBReplace { TLB_LRU, TLB_FIFO, TLB_RANDOM };
+const char *TLBReplaceNames[] = {"lru", "fifo", "random"};
+TLBReplace globalTLBReplace = TLB_LRU;
+bool globalTLBTagged = true; // false: flush the TLB on every context switch
+int globalPageWalk = 0; // cycles a TLB miss stalls the process
+int globalCopy = 100; // cycles to copy a resident frame on a copy-on-write fault
+int globalWriteBack = 1000; // disk cycles to write a dirty page out
+bool globalCleaner = false; // write dirty pages back while the disk is idle
+map<pmr::string, double> processStartTime;
 bool debugEnable = false;
 
 
-typedef string Interrupt;
+typedef pmr::string Interrupt;
 #define TimerMsg() ("")
 #define DiskMsg(pageName) (pageName)
 #define ProcessCreationMsg(processName) (processName)
@@ -50,35 +65,40 @@ class MemoryModel;
 class SchedulerBase
 {
 public:
-	virtual bool handleInterrupts(long long time, string currentProcess) {ERR}
-	virtual void processTermination(long long time, string currentProcess) {ERR}
-	virtual void pageFault(long long time, string faultingProcess, string faultingPage) {ERR}
-	virtual void diskInterrupt(long long time, string pageName) {ERR}
+	virtual bool handleInterrupts(long long time, const pmr::string &currentProcess) {ERR}
+	virtual void processTermination(long long time, const pmr::string &currentProcess) {ERR}
+	virtual void pageFault(long long time, const pmr::string &faultingProcess, const pmr::string &faultingPage) {ERR}
+	virtual void diskInterrupt(long long time, const pmr::string &pageName) {ERR}
 	virtual void initialize(SchedulerBase *s, CPUBase *c, MemoryBase *m) {ERR}
-	virtual void creationInterrupt(long long time, string processName) {ERR}
+	virtual void creationInterrupt(long long time, const pmr::string &processName) {ERR}
 	virtual long long closestInterruptTime() {ERR}
 	
 	virtual void debug() {ERR}
-	virtual void debugCheck(string page) {ERR}
+	virtual void debugCheck(const pmr::string &page) {ERR}
 };
 
 class CPUBase
 {
 public:
-	virtual void notifyContextSwitch(string newProcess, long long newProcessStartTime) {ERR}
+	virtual void notifyContextSwitch(const pmr::string &newProcess, long long newProcessStartTime) {ERR}
 	virtual void simulate() {ERR}
 	virtual void initialize(SchedulerBase *s, CPUBase *c, MemoryBase *m) {ERR}
-	virtual void creationInterrupt(long long time, string processName) {ERR}
-	virtual void pageFaultIncrease(string process) {ERR}
+	virtual void creationInterrupt(long long time, const pmr::string &processName) {ERR}
+	virtual void pageFaultIncrease(const pmr::string &process) {ERR}
 };
 
 class MemoryBase
 {
 public:
 	virtual void initialize(SchedulerBase *s, CPUBase *c, MemoryBase *m, MemoryModel *model) {ERR}
-	virtual bool fetch(long long time, string processName, string pageName) {ERR}
-	virtual bool swapPage(long long time, string faultingProcess, string faultingPage) {ERR}
-	virtual void pageArrival(string page) {ERR}
+	virtual bool fetch(long long time, const pmr::string &processName, const pmr::string &pageName, bool write) {ERR}
+	virtual bool swapPage(long long time, const pmr::string &faultingProcess, const pmr::string &faultingPage) {ERR}
+	virtual void pageArrival(const pmr::string &page) {ERR}
+	virtual void contextSwitch(const pmr::string &newProcess) {ERR}
+	virtual void retire() {ERR} // the last fetched reference ran
+	virtual void processExit(const pmr::string &processName) {ERR}
+	virtual long long translationStall() {ERR} // page walk cycles caused by the last fetch
+	virtual void report() {ERR}
 	
 	virtual void debug() {ERR}
 };
@@ -90,34 +110,252 @@ public:
 	int nextTimer;
 };*/
 
-void perror(string msg)
+void perror(const pmr::string &msg)
 {
 	cout << endl << msg << endl;
 	exit(0);
 }
 
+// self-profiling, build with -DPROFILE (make profile) to turn it on
+// times are inclusive, policy time also shows up under memory fetch and page faults
+#ifdef PROFILE
+
+enum ProfileSection { PROF_RUN, PROF_TRACE, PROF_INTERRUPTS, PROF_FETCH, PROF_FAULT, PROF_POLICY, PROF_DUMP, PROF_SECTIONS };
+const char *profileNames[PROF_SECTIONS] = {"simulation", "trace parsing", "interrupts", "memory fetch", "page faults", "replacement policy", "status dumps"};
+long long profileNs[PROF_SECTIONS], profileCalls[PROF_SECTIONS];
+
+long long profileClock()
+{
+	timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return now.tv_sec * 1000000000LL + now.tv_nsec;
+}
+
+class ProfileScope
+{
+	int section;
+	long long start;
+public:
+	ProfileScope(int s) : section(s), start(profileClock()) {}
+	~ProfileScope()
+	{
+		this->stop();
+	}
+	void stop()
+	{
+		if(start < 0) return;
+		profileNs[section] += profileClock() - start;
+		profileCalls[section]++;
+		start = -1;
+	}
+};
+
+void profileReport(long long references)
+{
+	double runNs = maxLL(profileNs[PROF_RUN], 1);
+	cout << "!! Profile: " << references << " references in " << runNs / 1e9 << "s, " << references * 1e9 / runNs << " references/s\n";
+	for(int i = PROF_TRACE; i < PROF_SECTIONS; i++) {
+		cout << "!! Profile " << profileNames[i] << ": " << profileNs[i] / 1e6 << "ms (" << profileNs[i] * 100.0 / runNs << "%), " << profileCalls[i] << " calls";
+		if(profileCalls[i] > 0) cout << ", " << profileNs[i] * 1.0 / profileCalls[i] << "ns/call";
+		cout << endl;
+	}
+}
+
+#define PROFILE_SCOPE(section) ProfileScope profileScope(section)
+#define PROFILE_STOP() profileScope.stop()
+#define PROFILE_REPORT(references) profileReport(references)
+#else
+#define PROFILE_SCOPE(section)
+#define PROFILE_STOP()
+#define PROFILE_REPORT(references)
+#endif
+
 typedef pair<int,long long> ProcessInfo;
 
+#define SHARED_OWNER "*"
+#define WRITE_MARK ":w"
+#define READ_MARK ":r"
+
+// numeric page names, as in the course traces
+bool pageNumber(const pmr::string &page, long long &number)
+{
+	if(page.empty() || page.size() > 18) return false;
+	number = 0;
+	for(size_t i = 0; i < page.size(); i++) {
+		if(page[i] < '0' || page[i] > '9') return false;
+		number = number * 10 + (page[i] - '0');
+	}
+	return true;
+}
+
+class SharedSegment
+{
+public:
+	pmr::set<pmr::string> pages;
+	pmr::vector<pair<long long,long long> > ranges; // numeric pages, both ends included
+	pmr::vector<pmr::string> prefixes;
+	bool copyOnWrite;
+	pmr::set<pmr::string> processes; // empty means every process
+	
+	typedef pmr::polymorphic_allocator<char> allocator_type;
+	SharedSegment(const allocator_type &alloc) : pages(alloc), ranges(alloc), prefixes(alloc), copyOnWrite(false), processes(alloc) {}
+	SharedSegment(const SharedSegment &other, const allocator_type &alloc) : pages(other.pages, alloc), ranges(other.ranges, alloc),
+		prefixes(other.prefixes, alloc), copyOnWrite(other.copyOnWrite), processes(other.processes, alloc) {}
+	
+	// comma separated list of "<page>", "<first>-<last>" or "<prefix>*"
+	void parsePages(const pmr::string &spec)
+	{
+		istringstream items(spec.c_str());
+		pmr::string item;
+		while(getline(items, item, ',')) {
+			size_t dash = item.find('-');
+			long long first, last;
+			if(item.empty()) continue;
+			else if(item[item.size() - 1] == '*') prefixes.push_back(item.substr(0, item.size() - 1));
+			else if(dash != string::npos && pageNumber(item.substr(0, dash), first) && pageNumber(item.substr(dash + 1), last)) {
+				if(first > last) perror("bad shared page range " + item);
+				ranges.push_back(make_pair(first, last));
+			}
+			else pages.insert(item);
+		}
+	}
+	
+	bool matches(const pmr::string &page)
+	{
+		if(pages.count(page)) return true;
+		long long number;
+		if(!ranges.empty() && pageNumber(page, number))
+			for(size_t i = 0; i < ranges.size(); i++)
+				if(ranges[i].first <= number && number <= ranges[i].second) return true;
+		for(size_t i = 0; i < prefixes.size(); i++)
+			if(page.compare(0, prefixes[i].size(), prefixes[i]) == 0) return true;
+		return false;
+	}
+};
+
+// trace tokens are "<page>", "<page>:r" or "<page>:w"
+// sidecar mapping file, one segment per line:
+//   <pages> <shared|cow> [process ...]
+// where pages is a comma separated list of "12", "100-199" or "lib*"
+// references to matching pages from the listed processes go to one frame
+// named "<page>b*<segment>" instead of the private "<page>b<process>", where segment is
+// the line's index, so two lines naming the same pages for different processes stay apart
+class SharedSegments
+{
+	pmr::vector<SharedSegment> segments;
+	pmr::set<pmr::string> privateCopies;
+	pmr::map<pmr::string, pmr::string> pendingCopies; // private copy not yet made -> shared page to copy from
+	
+	int segmentOf(const pmr::string &processName, const pmr::string &page)
+	{
+		for(size_t i = 0; i < segments.size(); i++)
+			if((segments[i].processes.empty() || segments[i].processes.count(processName)) && segments[i].matches(page))
+				return i;
+		return -1;
+	}
+	
+public:
+	long long cowFaults;
+	
+	SharedSegments(pmr::memory_resource *arena) : segments(arena), privateCopies(arena), pendingCopies(arena), cowFaults(0) {}
+	
+	void load(const pmr::string &fileName)
+	{
+		ifstream in(fileName.c_str());
+		if(!in) perror("cannot open shared segment file " + fileName);
+		pmr::string line;
+		while(getline(in, line)) {
+			if(line.empty() || line[0] == '#') continue;
+			istringstream fields(line.c_str());
+			SharedSegment segment(segments.get_allocator());
+			pmr::string pages, mode, process;
+			if(!(fields >> pages)) continue; // blank line
+			if(!(fields >> mode)) perror("shared segment without a mode: " + line);
+			segment.parsePages(pages);
+			if(mode != "shared" && mode != "cow") perror("bad shared segment mode " + mode);
+			segment.copyOnWrite = (mode == "cow");
+			while(fields >> process) segment.processes.insert(process);
+			segments.push_back(segment);
+		}
+	}
+	
+	bool enabled()
+	{
+		return !segments.empty();
+	}
+	
+	// maps a trace token to the page name the memory sees
+	pmr::string translate(const pmr::string &processName, pmr::string token, bool &write)
+	{
+		write = false;
+		if(token.size() > 2 && token.compare(token.size() - 2, 2, WRITE_MARK) == 0) {
+			write = true;
+			token.erase(token.size() - 2);
+		} else if(token.size() > 2 && token.compare(token.size() - 2, 2, READ_MARK) == 0) {
+			token.erase(token.size() - 2);
+		}
+		
+		pmr::string privatePage = token + "b" + processName;
+		if(segments.empty()) return privatePage;
+		int i = this->segmentOf(processName, token);
+		if(i < 0) return privatePage;
+		
+		pmr::string sharedPage = token + "b" SHARED_OWNER + to_string(i).c_str();
+		if(!segments[i].copyOnWrite) return sharedPage;
+		if(privateCopies.count(privatePage)) return privatePage;
+		if(!write) return sharedPage;
+		// first write: from now on this process has its own copy
+		privateCopies.insert(privatePage);
+		pendingCopies[privatePage] = sharedPage;
+		++cowFaults;
+		return privatePage;
+	}
+	
+	bool isShared(const pmr::string &pageName)
+	{
+		size_t end = pageName.size();
+		while(end > 0 && pageName[end - 1] >= '0' && pageName[end - 1] <= '9') end--;
+		return end < pageName.size() && end > 2 && pageName.compare(end - 2, 2, "b" SHARED_OWNER) == 0;
+	}
+	
+	// the first fault on a private copy takes it from the shared page, later ones come from swap
+	bool takeCopySource(const pmr::string &pageName, pmr::string &source)
+	{
+		if(pendingCopies.empty()) return false;
+		pmr::map<pmr::string, pmr::string>::iterator iter = pendingCopies.find(pageName);
+		if(iter == pendingCopies.end()) return false;
+		source = iter->second;
+		pendingCopies.erase(iter);
+		return true;
+	}
+};
+
+SharedSegments *sharedSegments;
+
 class Scheduler : SchedulerBase
 {
-	map<InterruptType, Interrupt> interrupts;
-	deque<string> faultQueue, readyQueue, hangedQueue, hangedPage;
-	set<string> blockedQueue;
-	map<string, string> blockedPage; // maps a process to a page
-	map<string, ProcessInfo> infoTable;
+	pmr::map<InterruptType, Interrupt> interrupts;
+	pmr::deque<pmr::string> faultQueue, readyQueue, hangedQueue, hangedPage;
+	pmr::set<pmr::string> blockedQueue;
+	pmr::map<pmr::string, pmr::string> blockedPage; // maps a process to a page
+	pmr::map<pmr::string, pmr::set<pmr::string> > pageWaiters; // maps a page to every process blocked on it
+	pmr::map<pmr::string, ProcessInfo> infoTable;
 	
 	CPUBase *cpu;
 	MemoryBase *memory;
 
 public:
+	Scheduler(pmr::memory_resource *arena) : interrupts(arena), faultQueue(arena), readyQueue(arena), hangedQueue(arena),
+		hangedPage(arena), blockedQueue(arena), blockedPage(arena), pageWaiters(arena), infoTable(arena) {}
+	
 	long long closestInterruptTime()
 	{
 		if(interrupts.begin() == interrupts.end()) return -1;
 		return (interrupts.begin()->first).first;
 	}
-	void debugCheck(string page)
+	void debugCheck(const pmr::string &page)
 	{
-		for(set<string>::iterator iter = blockedQueue.begin(); iter != blockedQueue.end(); iter++) {
+		for(pmr::set<pmr::string>::iterator iter = blockedQueue.begin(); iter != blockedQueue.end(); iter++) {
 			if(blockedPage[(*iter)] == page) {
 				perror("Gun");
 			}
@@ -128,16 +366,16 @@ public:
 	void debug()
 	{
 		cout << "!! faultQueue: ";
-		for(deque<string>::iterator iter = faultQueue.begin(); iter != faultQueue.end(); iter++) cout << (*iter) << " ";
+		for(pmr::deque<pmr::string>::iterator iter = faultQueue.begin(); iter != faultQueue.end(); iter++) cout << (*iter) << " ";
 		cout << endl;
 		cout << "!! readyQueue: ";
-		for(deque<string>::iterator iter = readyQueue.begin(); iter != readyQueue.end(); iter++) cout << (*iter) << " ";
+		for(pmr::deque<pmr::string>::iterator iter = readyQueue.begin(); iter != readyQueue.end(); iter++) cout << (*iter) << " ";
 		cout << endl;
 		cout << "!! blockedQueue: ";
-		for(set<string>::iterator iter = blockedQueue.begin(); iter != blockedQueue.end(); iter++) cout << (*iter) << "(" << blockedPage[*iter]  << ") ";
+		for(pmr::set<pmr::string>::iterator iter = blockedQueue.begin(); iter != blockedQueue.end(); iter++) cout << (*iter) << "(" << blockedPage[*iter]  << ") ";
 		cout << endl;
 		cout << "!! hangedQueue: ";
-		for(deque<string>::iterator iter = hangedQueue.begin(); iter != hangedQueue.end(); iter++) cout << (*iter) << " ";
+		for(pmr::deque<pmr::string>::iterator iter = hangedQueue.begin(); iter != hangedQueue.end(); iter++) cout << (*iter) << " ";
 		cout << endl;
 		
 	}
@@ -147,20 +385,23 @@ public:
 		memory = m;
 	}
 	
-	void creationInterrupt(long long time, string processName)
+	void creationInterrupt(long long time, const pmr::string &processName)
 	{
 		if(debugEnable)cout << "! Interrupt Creation: " << ProcessCreationMsg(processName) << " @ " << time << endl;
 		while(interrupts.find(ProcessCreationInterrupt(time)) != interrupts.end()) time++;
 		interrupts[ProcessCreationInterrupt(time)] = ProcessCreationMsg(processName);
 	}
 	
-	void diskInterrupt(long long time, string pageName)
+	void diskInterrupt(long long time, const pmr::string &pageName)
 	{
+		// frame copies finish off the disk's schedule and may collide with a read
+		while(interrupts.find(DiskInterrupt(time)) != interrupts.end()) time++;
 		interrupts[DiskInterrupt(time)] = pageName;
 	}
 	
-	bool handleInterrupts(long long time, string currentProcess)
+	bool handleInterrupts(long long time, const pmr::string &currentProcess)
 	{
+		PROFILE_SCOPE(PROF_INTERRUPTS);
 		if(debugEnable)cout << "Cycle: " << time << " interrupts " << interrupts.size() << endl;
 		
 		if(interrupts.size() == 0 && faultQueue.size() + readyQueue.size() + blockedQueue.size() + hangedQueue.size() == 0) return false;
@@ -177,27 +418,18 @@ public:
 		// handle Disk then
 		if(interrupts.find(DiskInterrupt(time)) != interrupts.end()) {
 			// add it to the fault queue
-			string faultingPage = msgParsePageName(interrupts[DiskInterrupt(time)]);
+			pmr::string faultingPage = msgParsePageName(interrupts[DiskInterrupt(time)]);
 			
-			for(set<string>::iterator iter = blockedQueue.begin(); iter != blockedQueue.end(); )
-				if(blockedPage[(*iter)] == faultingPage) {
-					string faultingProcess = (*iter);
-					faultQueue.push_back(faultingProcess);
-					
-					blockedPage.erase(blockedPage.find(faultingProcess));
-					set<string>::iterator titer = iter;
-					++iter;
-					if(iter != blockedQueue.end()) {
-						string tmp = *iter;
-						blockedQueue.erase(titer);
-						iter = blockedQueue.find(tmp);
-					} else {
-						blockedQueue.erase(titer);
-						break;
-					}
-				} else {
-					iter++;
+			// one read wakes everybody waiting on the page, shared or not
+			pmr::map<pmr::string, pmr::set<pmr::string> >::iterator waiters = pageWaiters.find(faultingPage);
+			if(waiters != pageWaiters.end()) {
+				for(pmr::set<pmr::string>::iterator iter = waiters->second.begin(); iter != waiters->second.end(); iter++) {
+					faultQueue.push_back(*iter);
+					blockedPage.erase(*iter);
+					blockedQueue.erase(*iter);
 				}
+				pageWaiters.erase(waiters);
+			}
 			
 			memory->pageArrival(faultingPage);
 			
@@ -218,7 +450,7 @@ public:
 					// going to sleep.. Zzzz...
 				}
 			} else { // something is runnable
-				string nextProcess = IDLE;
+				pmr::string nextProcess = IDLE;
 				if(faultQueue.size() != 0) {
 					nextProcess = faultQueue.front();
 					faultQueue.pop_front();
@@ -254,7 +486,7 @@ public:
 		return true;
 	}
 	
-	void processTermination(long long time, string currentProcess)
+	void processTermination(long long time, const pmr::string &currentProcess)
 	{
 		// revoke currentProcess's timer
 		int estTimer = infoTable[currentProcess].nextTimer;
@@ -268,6 +500,7 @@ public:
 				// success
 				blockedQueue.insert(hangedQueue[0]);
 				blockedPage[hangedQueue[0]] = hangedPage[0];
+				pageWaiters[hangedPage[0]].insert(hangedQueue[0]);
 				
 				hangedQueue.pop_front();
 				hangedPage.pop_front();
@@ -278,8 +511,9 @@ public:
 		cpu->notifyContextSwitch(IDLE, time + 1);
 	}
 	
-	void pageFault(long long time, string faultingProcess, string faultingPage)
+	void pageFault(long long time, const pmr::string &faultingProcess, const pmr::string &faultingPage)
 	{
+		PROFILE_SCOPE(PROF_FAULT);
 		if(debugEnable)cout << "! " << "Fault starts for " << faultingProcess << "\n";
 		
 		// IMPORTANT: we tell the memory to run a page replacement algorithm here
@@ -325,6 +559,7 @@ public:
 			blockedQueue.insert(faultingProcess);
 		
 			blockedPage[faultingProcess] = faultingPage;
+			pageWaiters[faultingPage].insert(faultingProcess);
 			cpu->notifyContextSwitch(IDLE, time);
 		} else {
 			// memory slot full, hang this process :(
@@ -343,34 +578,39 @@ class CPU : CPUBase
 {
 	SchedulerBase *scheduler;
 	MemoryBase *memory;
-	map<string, ifstream*> fd; // file descripters
-	map<string, string> reverseBuffer;
-	map<string, long long> cycleCount, pageFaultCount, terminationTime;
-	long long time, currentProcessStartTime;
+	pmr::map<pmr::string, ifstream*> fd; // file descripters
+	pmr::map<pmr::string, pmr::string> reverseBuffer; // raw trace tokens, translated again on resume
+	pmr::map<pmr::string, long long> cycleCount, pageFaultCount, terminationTime, pageWalkCount;
+	long long time, currentProcessStartTime, walkStallUntil;
 	long long idleCycles;
-	string currentProcess, nextMem;
+	pmr::string currentProcess, nextMem, nextRef;
+	bool nextWrite;
 	
-	bool readBuffer(string processName)
+	bool readBuffer(const pmr::string &processName)
 	{
+		PROFILE_SCOPE(PROF_TRACE);
 		if(reverseBuffer.find(processName) == reverseBuffer.end() || reverseBuffer[processName] == NOBUFFER)
 		{
 			ifstream *thisFd = fd[processName];
-			bool ret = ((*thisFd) >> nextMem);
-			nextMem += "b" + processName;
-			return ret;
+			if(((*thisFd) >> nextRef).fail()) return false;
+		} else {
+			nextRef = reverseBuffer[processName];
+			reverseBuffer[processName] = NOBUFFER;
 		}
-		nextMem = reverseBuffer[processName];
-		reverseBuffer[processName] = NOBUFFER;
+		nextMem = sharedSegments->translate(processName, nextRef, nextWrite);
 		return true;
 	}
 	
 public:
-	void cycleCountIncrease(string process)
+	CPU(pmr::memory_resource *arena) : fd(arena), reverseBuffer(arena), cycleCount(arena), pageFaultCount(arena),
+		terminationTime(arena), pageWalkCount(arena) {}
+	
+	void cycleCountIncrease(const pmr::string &process)
 	{
 		++cycleCount[process];
 	}
 	
-	void pageFaultIncrease(string process)
+	void pageFaultIncrease(const pmr::string &process)
 	{
 		++pageFaultCount[process];
 	}
@@ -380,24 +620,27 @@ public:
 		scheduler = s;
 		memory = m;
 	}
-	void notifyContextSwitch(string newProcess, long long newProcessStartTime)
+	void notifyContextSwitch(const pmr::string &newProcess, long long newProcessStartTime)
 	{	
 		if(debugEnable)cout << "! " << "Context switch: " << currentProcess << " -> " << newProcess << " to be started at " << newProcessStartTime << endl;
 			
 		if(nextMem != SOP && nextMem != EOP && currentProcess != IDLE) {
 			// nextMem not executed, restore nextMem to buffer
-			reverseBuffer[currentProcess] = nextMem;
+			reverseBuffer[currentProcess] = nextRef;
 		}
 		
 		
 		currentProcess = newProcess;
 		currentProcessStartTime = newProcessStartTime;
+		walkStallUntil = -1;
 		nextMem = SOP;
+		memory->contextSwitch(newProcess);
 	}
 	
 	void simulate()
 	{
-		time = -1; currentProcessStartTime = -1; currentProcess = IDLE; idleCycles = 0;
+		PROFILE_SCOPE(PROF_RUN);
+		time = -1; currentProcessStartTime = -1; currentProcess = IDLE; idleCycles = 0; walkStallUntil = -1;
 		do {
 			if(debugEnable)cout << "Start of cycle " << time + 1 << " : " << currentProcess << endl;
 			// start of a cycle
@@ -419,11 +662,13 @@ public:
 			}
 			// check if currentProcess is on a context switch
 			if(currentProcessStartTime > time) {++idleCycles; continue;}
+			// check if currentProcess is waiting for a page walk
+			if(walkStallUntil > time) {++pageWalkCount[currentProcess]; continue;}
 			
 			// new process?
 			if(fd.find(currentProcess) == fd.end()) {
 				ifstream *newFd = new ifstream;
-				string targetFile = currentProcess + ".mem";
+				pmr::string targetFile = currentProcess + ".mem";
 				newFd->open(targetFile.c_str());
 				if(debugEnable)cout << targetFile << " opened\n";
 				fd[currentProcess] = newFd;
@@ -437,6 +682,7 @@ public:
 			} else {
 				// do this cycle
 				this->cycleCountIncrease(currentProcess);
+				memory->retire();
 			}
 			
 			
@@ -449,16 +695,18 @@ public:
 				// switch to idle
 				cout << "!! " << currentProcess << " terminated at " << time  << " with total cycles: " << cycleCount[currentProcess] << " and page faults: " << pageFaultCount[currentProcess] << endl;
 				terminationTime[currentProcess] = time;
+				memory->processExit(currentProcess);
 				scheduler->processTermination(time, currentProcess);
 			
 			} else {
 				if(debugEnable)cout << "Read " << nextMem << endl;
 				// not end of program
 				// query memory
-				bool inMem = memory->fetch(time, currentProcess, nextMem);
+				bool inMem = memory->fetch(time, currentProcess, nextMem, nextWrite);
 				
 				if(debugEnable)cout << "Mem fetch " << inMem << " " << currentProcess << " : "<< cycleCount[currentProcess] << " \n";
 				if(cycleCount[currentProcess] % 10000 == 0) {
+					PROFILE_SCOPE(PROF_DUMP);
 					cout << "!!Mem fetch " << inMem << " " << currentProcess << " : "<< cycleCount[currentProcess] << " \n";
 					scheduler->debug();
 					// memory->debug();
@@ -468,7 +716,9 @@ public:
 					
 				if(inMem) { // nextMem in memory
 					// pretending page fetched
-					
+					// a TLB miss holds the reference back until the page walk is done
+					long long stall = memory->translationStall();
+					if(stall > 0) walkStallUntil = time + 1 + stall;
 				} else { //nextMem not in memory
 					// notify scheduler
 					// disk swapping actually happens here
@@ -480,262 +730,748 @@ public:
 			if(debugEnable)cout << "" << "Cycle " << time << " complete\n";
 			
 		} while(1);
+		PROFILE_STOP();
 		cout << "!! Simulation finished at cycle " << time << " with total idle time: " << idleCycles << endl;
 		cout << "!! To conclude:\n";
-		long long totalPageFaults = 0;
-		for(map<string,long long>::iterator iter = terminationTime.begin(); iter != terminationTime.end(); iter++) {
+		long long totalPageFaults = 0, totalPageWalks = 0, totalCycles = 0;
+		for(pmr::map<pmr::string,long long>::iterator iter = terminationTime.begin(); iter != terminationTime.end(); iter++) {
 			cout << "!! " << iter->first << " terminated at " << iter->second << ", ran " << cycleCount[iter->first] << " cycles for " << (iter->second) * 1.0 / globalCyclesPerSec - processStartTime[iter->first] << "s with " << pageFaultCount[iter->first] << " page faults.\n";
 			totalPageFaults += pageFaultCount[iter->first]; 
+			totalPageWalks += pageWalkCount[iter->first];
+			totalCycles += cycleCount[iter->first];
 		}
 		cout << "!! Total page faults: " << totalPageFaults << endl;
+		memory->report();
+		cout << "!! Cycles lost to page walks: " << totalPageWalks << endl;
+		PROFILE_REPORT(totalCycles);
 	}
 };
 
 // typedef pair<string,int> swappingInfo;
 
-class MemoryModel
+// one descriptor per physical frame, shared by every replacement policy
+class Frame
 {
 public:
-	virtual bool accessPage(long long time, string pageName) {ERR}
-	virtual bool insertPage(long long availTime, string pageName) {ERR} // always use this after kickOut
-	virtual void markBusy(string pageName) {ERR}
-	virtual void unmarkBusy(string pageName) {ERR}
-	virtual bool kickOut(long long time) {ERR}
-	virtual bool memoryFull() {ERR}
+	pmr::string page;
+	pmr::string owner; // last process to fault on the page, its first touch drops the fault pin
+	int pins;
+	long long availTime;
+	long long order; // sort key of the eviction list, see FrameTable::linkSorted
+	bool arriving, referenced, dirty;
+	int prev, next; // eviction list, only unpinned frames are linked
+	bool linked;
+	
+	// names are kept in the frame table's pool
+	typedef pmr::polymorphic_allocator<char> allocator_type;
+	Frame(const allocator_type &alloc) : page(alloc), owner(alloc), pins(0), availTime(0), order(0),
+		arriving(false), referenced(false), dirty(false), prev(-1), next(-1), linked(false) {}
+	Frame(const Frame &other, const allocator_type &alloc) : page(other.page, alloc), owner(other.owner, alloc),
+		pins(other.pins), availTime(other.availTime), order(other.order), arriving(other.arriving),
+		referenced(other.referenced), dirty(other.dirty), prev(other.prev), next(other.next), linked(other.linked) {}
 };
 
-class FIFOMemory : MemoryModel
+// frames live in one array; the unpinned ones also sit on an intrusive eviction
+// list kept in the order the policy wants to evict them, so pinned frames and
+// frames still on the disk never have to be skipped
+class FrameTable
 {
-	deque<string> pages;
-	map<string, bool> pageMarked;
-	map<string, long long> pageAvailTime;
+	pmr::vector<Frame> frames;
+	pmr::map<pmr::string, int> pageFrame;
+	pmr::vector<int> freeFrames;
+	int head, tail;
+	long long pinned, evictable;
+	
 public:
-	bool accessPage(long long time, string pageName)
-	{		
-		if(pageAvailTime.find(pageName) == pageAvailTime.end()) {
-			return false;
-		} else if(pageAvailTime[pageName] > time) {
-			return false;
-		}
-		return true;
+	FrameTable(pmr::memory_resource *arena) : frames(arena), pageFrame(arena), freeFrames(arena) {}
+	
+	void initialize(int count)
+	{
+		frames.assign(count, Frame(frames.get_allocator()));
+		freeFrames.clear();
+		for(int f = count - 1; f >= 0; f--) freeFrames.push_back(f);
+		head = tail = -1;
+		pinned = evictable = 0;
+	}
+	
+	Frame &operator[](int f)
+	{
+		return frames[f];
+	}
+	
+	int find(const pmr::string &pageName)
+	{
+		pmr::map<pmr::string, int>::iterator iter = pageFrame.find(pageName);
+		return (iter == pageFrame.end()) ? -1 : iter->second;
+	}
+	
+	bool full()
+	{
+		return freeFrames.empty();
+	}
+	
+	long long pinnedCount()
+	{
+		return pinned;
+	}
+	
+	long long evictableCount()
+	{
+		return evictable;
+	}
+	
+	// new frames come back pinned-free and unlinked, the caller pins or links them
+	int allocate(const pmr::string &pageName, long long availTime)
+	{
+		if(freeFrames.empty()) perror(pmr::string("frame table is full"));
+		int f = freeFrames.back();
+		freeFrames.pop_back();
+		Frame &frame = frames[f];
+		frame.page = pageName;
+		frame.owner = "";
+		frame.pins = 0;
+		frame.availTime = frame.order = availTime;
+		frame.arriving = frame.referenced = frame.dirty = false;
+		pageFrame[pageName] = f;
+		return f;
 	}
-	bool memoryFull()
+	
+	void release(int f)
 	{
-		return (pages.size() == globalPages);
+		if(frames[f].pins > 0) perror(pmr::string("releasing a pinned frame"));
+		this->unlink(f);
+		pageFrame.erase(frames[f].page);
+		freeFrames.push_back(f);
 	}
-	bool insertPage(long long availTime, string pageName)
+	
+	// true on the first pin, the policy then has to keep the frame's place
+	bool pin(int f)
 	{
-		pages.push_back(pageName);
-		pageAvailTime[pageName] = availTime;
-		pageMarked[pageName] = false;
+		if(frames[f].pins++ > 0) return false;
+		this->unlink(f);
+		pinned++;
 		return true;
 	}
-	void markBusy(string pageName)
+	
+	// true when the last pin is gone and the policy has to link the frame again
+	bool unpin(int f)
 	{
-		pageMarked[pageName] = true;
+		if(--frames[f].pins > 0) return false;
+		pinned--;
+		return true;
 	}
-	void unmarkBusy(string pageName)
+	
+	int first()
 	{
-		pageMarked[pageName] = false;
+		return head;
 	}
-	bool kickOut(long long time)
+	
+	int after(int f)
 	{
-		if(!this->memoryFull()) return false;
-		deque<string>::iterator iter = pages.begin();
-		while(pageMarked[(*iter)] || pageAvailTime[(*iter)] > time) {
-			iter++;
-			if(iter == pages.end()) {
-				// not expected
-				perror("memory kick out reached end of deque");
-			}
+		return frames[f].next;
+	}
+	
+	void linkBack(int f)
+	{
+		frames[f].prev = tail;
+		frames[f].next = -1;
+		if(tail != -1) frames[tail].next = f;
+		else head = f;
+		tail = f;
+		frames[f].linked = true;
+		evictable++;
+	}
+	
+	// keeps the list sorted by order; frames come back near the tail, so the walk is short
+	void linkSorted(int f)
+	{
+		int before = tail;
+		while(before != -1 && frames[before].order > frames[f].order) before = frames[before].prev;
+		if(before == tail) {
+			this->linkBack(f);
+			return;
 		}
-		string kickout = (*iter);
-		pages.erase(iter);
-		pageMarked.erase(pageMarked.find(kickout));
-		pageAvailTime.erase(pageAvailTime.find(kickout));
-		return true;
-	}	
+		int behind = (before == -1) ? head : frames[before].next;
+		frames[f].prev = before;
+		frames[f].next = behind;
+		frames[behind].prev = f;
+		if(before != -1) frames[before].next = f;
+		else head = f;
+		frames[f].linked = true;
+		evictable++;
+	}
+	
+	void unlink(int f)
+	{
+		if(!frames[f].linked) return;
+		if(frames[f].prev != -1) frames[frames[f].prev].next = frames[f].next;
+		else head = frames[f].next;
+		if(frames[f].next != -1) frames[frames[f].next].prev = frames[f].prev;
+		else tail = frames[f].prev;
+		frames[f].prev = frames[f].next = -1;
+		frames[f].linked = false;
+		evictable--;
+	}
+	
+	void moveBack(int f)
+	{
+		if(!frames[f].linked || f == tail) return;
+		this->unlink(f);
+		this->linkBack(f);
+	}
+	
+	void debug()
+	{
+		for(size_t f = 0; f < frames.size(); f++)
+			if(frames[f].arriving)
+				cout << "!! Awaiting page: " << frames[f].page << " to be available at " << frames[f].availTime << endl;
+	}
+};
+
+// replacement policies only order the eviction list of the frame table
+class MemoryModel
+{
+public:
+	virtual void attach(FrameTable *table) {ERR}
+	virtual void admitFrame(int frame) {ERR} // a page was just placed in frame
+	virtual void touchFrame(long long time, int frame, bool write) {ERR} // recency and dirty update
+	virtual void holdFrame(int frame) {ERR} // frame got its first pin and left the eviction list
+	virtual void linkFrame(int frame) {ERR} // frame lost its last pin and can be evicted again
+	virtual int pickVictim(long long time) {ERR}
+};
+
+class FIFOMemory : MemoryModel
+{
+	FrameTable *frames;
+	long long arrivals;
+public:
+	void attach(FrameTable *table)
+	{
+		frames = table;
+		arrivals = 0;
+	}
+	void admitFrame(int frame)
+	{
+		(*frames)[frame].order = ++arrivals;
+	}
+	void touchFrame(long long time, int frame, bool write)
+	{
+		// arrival order only, nothing to update
+		if(write) (*frames)[frame].dirty = true;
+	}
+	void holdFrame(int frame)
+	{
+		// linkSorted puts it back by arrival
+	}
+	void linkFrame(int frame)
+	{
+		frames->linkSorted(frame);
+	}
+	int pickVictim(long long time)
+	{
+		return frames->first();
+	}
 };
 
-typedef pair<long long,string> reverseAccessType;
-#define reverseAccessElement(x,y) make_pair((x),(y))
 class LRUMemory : MemoryModel
 {
-	map<string, bool> pageMarked;
-	map<string, long long> pageAvailTime, pageAccessTime;
-	set<reverseAccessType> reverseAccess;
+	FrameTable *frames;
 public:
-	bool accessPage(long long time, string pageName)
-	{		
-		if(pageAvailTime.find(pageName) == pageAvailTime.end()) {
-			return false;
-		} else if(pageAvailTime[pageName] > time) {
-			return false;
+	void attach(FrameTable *table)
+	{
+		frames = table;
+	}
+	void admitFrame(int frame)
+	{
+		// order already holds the arrival time
+	}
+	void touchFrame(long long time, int frame, bool write)
+	{
+		Frame &f = (*frames)[frame];
+		if(f.order < time) {
+			f.order = time;
+			frames->moveBack(frame);
 		}
-		
-		if(pageAccessTime[pageName] < time) {
-			reverseAccess.erase(reverseAccess.find(reverseAccessElement(pageAccessTime[pageName], pageName)));
-			reverseAccess.insert(reverseAccessElement(time, pageName));
-			pageAccessTime[pageName] = time;
+		if(write) f.dirty = true;
+	}
+	void holdFrame(int frame)
+	{
+		// linkSorted puts it back by last access
+	}
+	void linkFrame(int frame)
+	{
+		frames->linkSorted(frame);
+	}
+	int pickVictim(long long time)
+	{
+		return frames->first();
+	}
+};
+
+class SCAMemory : MemoryModel
+{
+protected:
+	FrameTable *frames;
+	long long rotations; // order is the position in the ring
+	pmr::set<pair<long long,int> > held; // pinned frames by position, they stay in the ring while off the list
+	
+	// the hand reached this position, pinned frames in front of it go to the back with their bits untouched
+	void pass(long long order)
+	{
+		while(!held.empty() && held.begin()->first < order) {
+			int f = held.begin()->second;
+			held.erase(held.begin());
+			(*frames)[f].order = ++rotations;
+			held.insert(make_pair(rotations, f));
 		}
-		
-		return true;
 	}
-	bool memoryFull()
+	
+	// the hand carries a frame to the back of the ring
+	void rotate(int f)
 	{
-		return (reverseAccess.size() == globalPages);
+		this->pass((*frames)[f].order);
+		(*frames)[f].order = ++rotations;
+		frames->moveBack(f);
 	}
-	bool insertPage(long long availTime, string pageName)
+public:
+	SCAMemory(pmr::memory_resource *arena) : held(arena) {}
+	
+	void attach(FrameTable *table)
 	{
-		pageAvailTime[pageName] = availTime;
-		pageMarked[pageName] = false;
-		pageAccessTime[pageName] = availTime;
-		reverseAccess.insert(reverseAccessElement(availTime, pageName));
-		return true;
+		frames = table;
+		rotations = 0;
+		held.clear();
 	}
-	void markBusy(string pageName)
+	void admitFrame(int frame)
 	{
-		pageMarked[pageName] = true;
+		(*frames)[frame].referenced = true;
+		(*frames)[frame].order = ++rotations;
 	}
-	void unmarkBusy(string pageName)
+	void touchFrame(long long time, int frame, bool write)
 	{
-		pageMarked[pageName] = false;
+		(*frames)[frame].referenced = true;
+		if(write) (*frames)[frame].dirty = true;
 	}
-	bool kickOut(long long time)
+	void holdFrame(int frame)
 	{
-		if(!this->memoryFull()) return false;
-		set<reverseAccessType>::iterator iter = reverseAccess.begin();
-		while(pageMarked[iter->second] || pageAvailTime[iter->second] > time) {
-			iter++;
-			if(iter == reverseAccess.end()) {
-				// not expected
-				perror("kick out reached the end of set");
+		held.insert(make_pair((*frames)[frame].order, frame));
+	}
+	void linkFrame(int frame)
+	{
+		held.erase(make_pair((*frames)[frame].order, frame));
+		frames->linkSorted(frame);
+	}
+	int pickVictim(long long time)
+	{
+		int f = frames->first();
+		while(f != -1 && (*frames)[f].referenced) {
+			(*frames)[f].referenced = false;
+			this->rotate(f);
+			f = frames->first();
+		}
+		if(f != -1) this->pass((*frames)[f].order);
+		return f;
+	}
+};
+
+// enhanced second chance (NRU): prefer unreferenced clean pages, then unreferenced dirty ones
+class NRUMemory : SCAMemory
+{
+public:
+	NRUMemory(pmr::memory_resource *arena) : SCAMemory(arena) {}
+	
+	int pickVictim(long long time)
+	{
+		// sweep 1 and 3 look for (0,0) and leave the bits alone
+		// sweep 2 and 4 look for (0,1) and clear reference bits on the way
+		for(int sweep = 0; sweep < 4; sweep++) {
+			bool wantDirty = (sweep % 2 == 1);
+			for(long long n = frames->evictableCount(); n > 0; n--) {
+				int f = frames->first();
+				if(!(*frames)[f].referenced && (*frames)[f].dirty == wantDirty) {
+					this->pass((*frames)[f].order);
+					return f;
+				}
+				if(wantDirty) (*frames)[f].referenced = false;
+				this->rotate(f);
 			}
 		}
-		string kickout = iter->second;
-		reverseAccess.erase(iter);
-		pageAccessTime.erase(kickout);
-		pageMarked.erase(pageMarked.find(kickout));
-		pageAvailTime.erase(pageAvailTime.find(kickout));
-		return true;
-	}	
+		return -1;
+	}
 };
 
-class SCAMemory : MemoryModel
+class TLBEntry
 {
-	deque<string> pages;
-	map<string, bool> pageMarked, pageRef;
-	map<string, long long> pageAvailTime;
 public:
-	bool accessPage(long long time, string pageName)
-	{		
-		if(pageAvailTime.find(pageName) == pageAvailTime.end()) {
-			return false;
-		} else if(pageAvailTime[pageName] > time) {
-			return false;
-		}
-		pageRef[pageName] = true;
-		return true;
+	bool valid;
+	pmr::string process, page;
+	int frame;
+	long long stamp; // last use for lru, fill order for fifo
+	
+	typedef pmr::polymorphic_allocator<char> allocator_type;
+	TLBEntry(const allocator_type &alloc) : valid(false), process(alloc), page(alloc), frame(-1), stamp(0) {}
+	TLBEntry(const TLBEntry &other, const allocator_type &alloc) : valid(other.valid), process(other.process, alloc),
+		page(other.page, alloc), frame(other.frame), stamp(other.stamp) {}
+};
+
+// set-associative, entries tagged with the owning process
+// the set is picked by page name only so an eviction can shoot a page down in one set
+class TLB
+{
+	pmr::vector<TLBEntry> entries;
+	int sets, ways;
+	long long clock;
+	struct Counters {
+		long long hits, misses;
+	};
+	pmr::map<pmr::string, Counters> counts;
+	Counters *current; // the running process's counters, looked up once per context switch
+	long long *pending; // counter of the last translation, bumped by retire once its reference runs
+	
+	int setOf(const pmr::string &pageName)
+	{
+		unsigned long hash = 5381;
+		for(size_t i = 0; i < pageName.size(); i++) hash = hash * 33 + (unsigned char)pageName[i];
+		return hash % sets;
 	}
-	bool memoryFull()
+	
+public:
+	TLB(pmr::memory_resource *arena) : entries(arena), counts(arena), current(NULL), pending(NULL) {}
+	
+	void initialize(int entryCount, int wayCount)
 	{
-		return (pages.size() == globalPages);
+		clock = 0;
+		ways = (wayCount < 1) ? 1 : wayCount;
+		if(ways > entryCount) ways = entryCount;
+		if(entryCount > 0 && entryCount % ways != 0) perror(pmr::string("tlb= is not a multiple of ways="));
+		sets = (entryCount > 0) ? entryCount / ways : 0;
+		entries.assign(sets * ways, TLBEntry(entries.get_allocator()));
 	}
-	bool insertPage(long long availTime, string pageName)
+	
+	bool enabled()
 	{
-		pages.push_back(pageName);
-		pageAvailTime[pageName] = availTime;
-		pageMarked[pageName] = false;
-		pageRef[pageName] = true;
-		return true;
+		return sets > 0;
 	}
-	void markBusy(string pageName)
+	
+	// lookups and fills are counted against this process until the next switch
+	// a translated reference that did not get to run is dropped, it is translated again when the process is back
+	void switchTo(const pmr::string &processName)
 	{
-		pageMarked[pageName] = true;
+		current = &counts[processName];
+		pending = NULL;
 	}
-	void unmarkBusy(string pageName)
+	
+	// the last translated reference ran, so hits + misses is the number of references run
+	void retire()
 	{
-		pageMarked[pageName] = false;
+		if(pending) ++*pending;
+		pending = NULL;
 	}
-	bool kickOut(long long time)
+	
+	// the frame holding the page, -1 on a miss
+	// misses are only counted by fill, a lookup for a page that is not resident is a page fault
+	int lookup(const pmr::string &processName, const pmr::string &pageName)
 	{
-		if(!this->memoryFull()) return false;
-		deque<string>::iterator iter = pages.begin();
-		while(pageMarked[(*iter)] || pageAvailTime[(*iter)] > time || pageRef[(*iter)]) {
-			if(!(pageMarked[(*iter)] || pageAvailTime[(*iter)] > time)) pageRef[(*iter)] = false;
-			pages.push_back(*iter);
-			pages.erase(iter);
-			iter = pages.begin();
+		pending = NULL;
+		if(!this->enabled()) return -1;
+		int base = this->setOf(pageName) * ways;
+		for(int i = base; i < base + ways; i++) {
+			if(entries[i].valid && entries[i].page == pageName && entries[i].process == processName) {
+				if(globalTLBReplace == TLB_LRU) entries[i].stamp = ++clock;
+				pending = &current->hits;
+				return entries[i].frame;
+			}
 		}
-		string kickout = (*iter);
-		pages.erase(iter);
-		pageRef.erase(pageRef.find(kickout));
-		pageMarked.erase(pageMarked.find(kickout));
-		pageAvailTime.erase(pageAvailTime.find(kickout));
-		return true;
-	}	
+		return -1;
+	}
+	
+	// a miss that found the page resident, i.e. a page walk
+	void fill(const pmr::string &processName, const pmr::string &pageName, int frame)
+	{
+		if(!this->enabled()) return;
+		pending = &current->misses;
+		int base = this->setOf(pageName) * ways;
+		int slot = base;
+		for(int i = base; i < base + ways; i++) {
+			if(!entries[i].valid) {
+				slot = i;
+				break;
+			}
+			if(entries[i].stamp < entries[slot].stamp) slot = i;
+		}
+		if(entries[slot].valid && globalTLBReplace == TLB_RANDOM) slot = base + rand() % ways;
+		entries[slot].valid = true;
+		entries[slot].process = processName;
+		entries[slot].page = pageName;
+		entries[slot].frame = frame;
+		entries[slot].stamp = ++clock;
+	}
+	
+	void invalidate(const pmr::string &pageName)
+	{
+		if(!this->enabled()) return;
+		int base = this->setOf(pageName) * ways;
+		for(int i = base; i < base + ways; i++)
+			if(entries[i].valid && entries[i].page == pageName) entries[i].valid = false;
+	}
+	
+	void flush()
+	{
+		for(size_t i = 0; i < entries.size(); i++) entries[i].valid = false;
+	}
+	
+	void report()
+	{
+		if(!this->enabled()) {
+			cout << "!! TLB disabled\n";
+			return;
+		}
+		long long totalHits = 0, totalMisses = 0;
+		for(pmr::map<pmr::string,Counters>::iterator iter = counts.begin(); iter != counts.end(); iter++) {
+			long long hits = iter->second.hits, misses = iter->second.misses;
+			if(hits + misses == 0) continue; // the idle process, or one that never got past its first fault
+			cout << "!! " << iter->first << " TLB hits: " << hits << ", misses: " << misses << ", hit rate: " << hits * 100.0 / (hits + misses) << "%\n";
+			totalHits += hits;
+			totalMisses += misses;
+		}
+		cout << "!! TLB (" << sets * ways << " entries, " << ways << "-way, " << TLBReplaceNames[globalTLBReplace] << (globalTLBTagged ? ", tagged" : ", flushed") << ") hits: " << totalHits << ", misses: " << totalMisses << " (page faults not included)";
+		if(totalHits + totalMisses > 0) cout << ", hit rate: " << totalHits * 100.0 / (totalHits + totalMisses) << "%";
+		cout << endl;
+	}
 };
 
 class Memory : MemoryBase
 {
-	map<string, long long> awaitingTime;
-	map<string, string> lastFaultProcess;
+	FrameTable frames;
 	MemoryModel *mmu;
 	SchedulerBase *scheduler;
-	long long busyUntil, busyCount; // should be -1 at first
+	TLB tlb;
+	long long busyUntil; // should be -1 at first
+	long long lastStall;
+	pmr::map<pmr::string, pmr::set<pmr::string> > pageMappers, pageFaulters; // resident shared pages only
+	long long framesSaved, peakFramesSaved, faultsAvoided, readsAvoided, frameCopies;
+	long long faultWriteBacks, backgroundWriteBacks, writeBackWait, nextClean;
+	
+	void pin(int f)
+	{
+		PROFILE_SCOPE(PROF_POLICY);
+		if(frames.pin(f)) mmu->holdFrame(f);
+	}
+	
+	void unpin(int f)
+	{
+		PROFILE_SCOPE(PROF_POLICY);
+		if(frames.unpin(f)) mmu->linkFrame(f);
+	}
+	
+	// write one dirty page back if the disk has nothing else to do
+	void clean(long long time)
+	{
+		if(busyUntil > time || nextClean > time) return;
+		// the page the policy would evict soonest
+		int f = frames.first();
+		while(f != -1 && !frames[f].dirty) f = frames.after(f);
+		if(f == -1) {
+			// nothing dirty, look again after a write-back's worth of cycles
+			nextClean = time + globalWriteBack;
+			return;
+		}
+		frames[f].dirty = false;
+		busyUntil = time + globalWriteBack;
+		backgroundWriteBacks++;
+		if(debugEnable)cout << "! Cleaning " << frames[f].page << " until " << busyUntil << endl;
+	}
+	
+	void mapShared(const pmr::string &processName, const pmr::string &pageName)
+	{
+		pmr::set<pmr::string> &mappers = pageMappers[pageName];
+		if(!mappers.insert(processName).second) return;
+		if(mappers.size() > 1) {
+			framesSaved++;
+			peakFramesSaved = maxLL(peakFramesSaved, framesSaved);
+		}
+		if(pageFaulters[pageName].count(processName) == 0) faultsAvoided++;
+	}
+	
+	void unmapShared(const pmr::string &processName, const pmr::string &pageName)
+	{
+		pmr::map<pmr::string, pmr::set<pmr::string> >::iterator iter = pageMappers.find(pageName);
+		if(iter == pageMappers.end()) return;
+		if(iter->second.erase(processName) && iter->second.size() > 0) framesSaved--;
+	}
+	
+	void evictShared(const pmr::string &pageName)
+	{
+		pmr::map<pmr::string, pmr::set<pmr::string> >::iterator iter = pageMappers.find(pageName);
+		if(iter != pageMappers.end()) {
+			if(iter->second.size() > 1) framesSaved -= iter->second.size() - 1;
+			pageMappers.erase(iter);
+		}
+		pageFaulters.erase(pageName);
+	}
 	
 public:
+	Memory(pmr::memory_resource *arena) : frames(arena), tlb(arena), pageMappers(arena), pageFaulters(arena) {}
+	
 	void initialize(SchedulerBase *s, CPUBase *c, MemoryBase *m, MemoryModel *model)
 	{
 		scheduler = s;
 		busyUntil = -1;
-		busyCount = 0;
+		lastStall = 0;
+		framesSaved = peakFramesSaved = faultsAvoided = readsAvoided = frameCopies = 0;
+		faultWriteBacks = backgroundWriteBacks = writeBackWait = nextClean = 0;
+		frames.initialize(globalPages);
 		mmu = model;
+		mmu->attach(&frames);
+		tlb.initialize(globalTLBEntries, globalTLBWays);
+	}
+	
+	void contextSwitch(const pmr::string &newProcess)
+	{
+		tlb.switchTo(newProcess);
+		if(!globalTLBTagged) tlb.flush();
+	}
+	
+	long long translationStall()
+	{
+		return lastStall;
+	}
+	
+	void retire()
+	{
+		tlb.retire();
+	}
+	
+	void processExit(const pmr::string &processName)
+	{
+		for(pmr::map<pmr::string, pmr::set<pmr::string> >::iterator iter = pageMappers.begin(); iter != pageMappers.end(); iter++)
+			this->unmapShared(processName, iter->first);
+	}
+	
+	void report()
+	{
+		tlb.report();
+		cout << "!! Dirty pages written back: " << faultWriteBacks << " on page faults (" << writeBackWait << " cycles waited), " << backgroundWriteBacks << " in the background\n";
+		if(sharedSegments->enabled()) {
+			cout << "!! Sharing saved at most " << peakFramesSaved << " frames, avoided " << faultsAvoided << " page faults and " << readsAvoided << " disk reads\n";
+			cout << "!! Copy-on-write faults: " << sharedSegments->cowFaults << ", " << frameCopies << " served by copying a resident frame\n";
+		}
 	}
 	
 	void debug()
 	{
-		for(map<string,long long>::iterator iter = awaitingTime.begin(); iter != awaitingTime.end(); iter++)
-			cout << "!! Awaiting page: " << iter->first << " to be available at " << iter->second << endl;
+		frames.debug();
 	}
 	
-	void pageArrival(string page)
+	void pageArrival(const pmr::string &page)
 	{
-		awaitingTime.erase(awaitingTime.find(page));
+		// a wake-up for a resident page may find it already evicted again
+		int f = frames.find(page);
+		if(f != -1) frames[f].arriving = false;
 	}
-	bool fetch(long long time, string processName, string pageName)
+	bool fetch(long long time, const pmr::string &processName, const pmr::string &pageName, bool write)
 	{
+		PROFILE_SCOPE(PROF_FETCH);
 		if(debugEnable)cout << "Going to fetch " << pageName << "\n";
-		//this->updateAwaitingPages(time);
-		if(debugEnable)cout << "Done updateAwaitingPages\n";
-		if(lastFaultProcess.find(pageName) != lastFaultProcess.end()) {
-			if(lastFaultProcess[pageName] == processName) {
-				mmu->unmarkBusy(pageName);
-				busyCount--;
-				lastFaultProcess.erase(lastFaultProcess.find(pageName));
-			}
+		lastStall = 0;
+		if(globalCleaner) this->clean(time);
+		// fast path: a TLB hit only needs the policy's recency update
+		int f = tlb.lookup(processName, pageName);
+		if(f != -1) {
+			PROFILE_SCOPE(PROF_POLICY);
+			mmu->touchFrame(time, f, write);
+			return true;
+		}
+		f = frames.find(pageName);
+		if(f == -1) return false;
+		bool available = (frames[f].availTime <= time);
+		if(available) {
+			PROFILE_SCOPE(PROF_POLICY);
+			mmu->touchFrame(time, f, write);
+		}
+		if(frames[f].owner == processName) {
+			// the faulting process is back, the frame may be evicted again
+			frames[f].owner = "";
+			this->unpin(f);
 		}
 		if(debugEnable)cout << "Done lastFault check\n";
-		return mmu->accessPage(time, pageName);
+		if(!available) return false;
+		if(sharedSegments->isShared(pageName)) this->mapShared(processName, pageName);
+		if(tlb.enabled()) {
+			tlb.fill(processName, pageName, f);
+			lastStall = globalPageWalk;
+		}
+		return true;
 	}
-	bool swapPage(long long time, string faultingProcess, string faultingPage)
+	bool swapPage(long long time, const pmr::string &faultingProcess, const pmr::string &faultingPage)
 	{
-		//this->updateAwaitingPages(time);
-		lastFaultProcess[faultingPage] = faultingProcess;
-		if(awaitingTime.find(faultingPage) != awaitingTime.end()) {
+		bool shared = sharedSegments->isShared(faultingPage);
+		if(shared) pageFaulters[faultingPage].insert(faultingProcess);
+		int f = frames.find(faultingPage);
+		if(f != -1 && frames[f].arriving) {
 			// already on a transfer
-			// nothing to do
+			// the pin now waits for this process instead
+			if(frames[f].owner == "") this->pin(f);
+			frames[f].owner = faultingProcess;
+			if(shared) readsAvoided++;
 			return true;
-		} else if(busyCount < globalPages) {
-			long long ETA = maxLL(time, busyUntil) + globalSwap;
-			awaitingTime[faultingPage] = ETA;
+		} else if(f != -1) {
+			// someone else brought the page in while this process was hanged,
+			// nothing to read, just wake it up on the next cycle
+			if(shared) readsAvoided++;
+			scheduler->diskInterrupt(time + 1, faultingPage);
+			return true;
+		} else if(frames.pinnedCount() < globalPages) {
+			// free a frame first, a dirty victim has to reach the disk before the frame is reused
+			long long frameFree = time;
+			pmr::string source;
+			int sourceFrame = -1;
+			if(sharedSegments->takeCopySource(faultingPage, source)) {
+				this->unmapShared(faultingProcess, source);
+				// copy-on-write of a resident frame, the disk is not involved
+				// and the source must survive the eviction below, unless it is the only candidate
+				sourceFrame = frames.find(source);
+				if(sourceFrame != -1 && (frames[sourceFrame].availTime > time ||
+					(frames.full() && frames[sourceFrame].pins == 0 && frames.evictableCount() == 1)))
+					sourceFrame = -1;
+				if(sourceFrame != -1) {
+					mmu->touchFrame(time, sourceFrame, false);
+					this->pin(sourceFrame);
+				}
+			}
+			if(frames.full()) {
+				int victim;
+				{
+					PROFILE_SCOPE(PROF_POLICY);
+					victim = mmu->pickVictim(time);
+				}
+				if(victim == -1) perror(pmr::string("no frame to kick out"));
+				pmr::string victimPage = frames[victim].page;
+				tlb.invalidate(victimPage);
+				if(sharedSegments->isShared(victimPage)) this->evictShared(victimPage);
+				if(frames[victim].dirty) {
+					frameFree = busyUntil = maxLL(time, busyUntil) + globalWriteBack;
+					writeBackWait += globalWriteBack; // only the delay the write-back adds, not the queue ahead of it
+					faultWriteBacks++;
+				}
+				frames.release(victim);
+			}
+			if(sourceFrame != -1) this->unpin(sourceFrame);
 			
-			busyUntil = ETA;
+			long long ETA;
+			if(sourceFrame != -1) {
+				ETA = frameFree + globalCopy;
+				frameCopies++;
+			} else {
+				ETA = maxLL(time, busyUntil) + globalSwap;
+				busyUntil = ETA;
+			}
 			
-			mmu->kickOut(time);
-			mmu->insertPage(ETA, faultingPage);
-			mmu->markBusy(faultingPage);
-			busyCount++;
+			f = frames.allocate(faultingPage, ETA);
+			frames[f].arriving = true;
+			frames[f].owner = faultingProcess;
+			mmu->admitFrame(f);
+			this->pin(f);
 			
 			scheduler->diskInterrupt(ETA, faultingPage);
 			return true;
@@ -745,19 +1481,49 @@ public:
 	}
 };
 
+// optional trailing arguments, e.g. tlb=128 ways=8 tlbrepl=fifo tagged=0 walk=20 shared=segments.txt copy=100
+// writeback=1000 cleaner=1
+void parseOption(const pmr::string &option)
+{
+	size_t split = option.find('=');
+	if(split == string::npos) perror("bad option " + option);
+	pmr::string key = option.substr(0, split), value = option.substr(split + 1);
+	if(key == "tlb") globalTLBEntries = atoi(value.c_str());
+	else if(key == "ways") globalTLBWays = atoi(value.c_str());
+	else if(key == "tlbrepl") {
+		if(value == "lru") globalTLBReplace = TLB_LRU;
+		else if(value == "fifo") globalTLBReplace = TLB_FIFO;
+		else if(value == "random") globalTLBReplace = TLB_RANDOM;
+		else perror("unknown TLB replacement " + value);
+	}
+	else if(key == "tagged") globalTLBTagged = (atoi(value.c_str()) != 0);
+	else if(key == "walk") globalPageWalk = atoi(value.c_str());
+	else if(key == "shared") sharedSegments->load(value);
+	else if(key == "copy") globalCopy = atoi(value.c_str());
+	else if(key == "writeback") globalWriteBack = atoi(value.c_str());
+	else if(key == "cleaner") globalCleaner = (atoi(value.c_str()) != 0);
+	else perror("unknown option " + key);
+}
+
 int main(int argc, char *argv[])
 {
 	freopen(argv[4], "r", stdin);
 	globalPages = atoi(argv[1]);
 	globalQuantum = atoi(argv[2]);
-	CPUBase *myCPU = (CPUBase *)(new CPU);
-	MemoryBase *myMemory = (MemoryBase *)(new Memory);
-	SchedulerBase *myScheduler = (SchedulerBase *)(new Scheduler);
+	// every container of this simulation draws its nodes from one pool,
+	// handed back in one go when the pool goes out of scope at the end of the run
+	pmr::unsynchronized_pool_resource arena;
+	sharedSegments = new SharedSegments(&arena);
+	for(int i = 5; i < argc; i++) parseOption(argv[i]);
+	CPUBase *myCPU = (CPUBase *)(new CPU(&arena));
+	MemoryBase *myMemory = (MemoryBase *)(new Memory(&arena));
+	SchedulerBase *myScheduler = (SchedulerBase *)(new Scheduler(&arena));
 	MemoryModel *myModel;
 	
 	if(argv[3] == FIFO) myModel = (MemoryModel *)(new FIFOMemory);
 	else if(argv[3] == LRU) myModel = (MemoryModel *)(new LRUMemory);
-	else if(argv[3] == SCA) myModel = (MemoryModel *)(new SCAMemory);
+	else if(argv[3] == SCA) myModel = (MemoryModel *)(new SCAMemory(&arena));
+	else if(argv[3] == NRU) myModel = (MemoryModel *)(new NRUMemory(&arena));
 	
 	myScheduler->initialize(myScheduler, myCPU, myMemory);
 	myCPU->initialize(myScheduler, myCPU, myMemory);
@@ -766,7 +1532,7 @@ int main(int argc, char *argv[])
 	char buffer[255]; double runTime, burstTime, IOTime;
 	while(scanf("%s %lf %lf %lf", buffer, &runTime, &burstTime, &IOTime) != EOF) {
 		myScheduler->creationInterrupt(runTime * globalCyclesPerSec, buffer);
-		string process = buffer;
+		pmr::string process = buffer;
 		processStartTime[buffer] = runTime;
 	}
 	